@@ -0,0 +1,506 @@
+/*  dupes.c
+ *
+ *  Copyright 2018 Steven Anthony (Tony) Williams
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Duplicate file detection (--dupes).
+ *
+ * Regular files are collected during the normal search. Afterwards they
+ * are grouped by size, and only files whose sizes collide get read. The
+ * first pass hashes the first and last PART_SIZE bytes, the second pass
+ * hashes the whole file, and only for files still colliding after the
+ * first. Both passes run across a small pool of threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "hbs.h"
+
+#define  PART_SIZE          4096
+#define  CHUNK_SIZE         (1024*1024)   /* Full hash read/hash unit */
+#define  MAX_THREADS        16
+
+typedef struct
+{
+   char    *path;
+   ul64    size,
+           dev,
+           ino,
+           hash;
+   bool    isBad;      /* Could not be read, or is an extra hard link */
+} DUPE;
+
+typedef struct
+{
+   ul64    size;
+   ul64    count;
+} SIZESLOT;
+
+typedef struct
+{
+   ul64    first,
+           last,
+           reclaim;
+} GROUP;
+
+typedef struct
+{
+   DUPE    *list;
+   ul64    count;
+   ul64    next;
+   void    (*work)(DUPE *);
+   pthread_mutex_t   lock;
+} POOL;
+
+static DUPE    *dupes = NULL;
+static ul64    dupeCount = 0,
+               dupeMax = 0;
+
+void dupesAdd(const char *dir, const char *name, STAT *s)
+{
+   DUPE   *d;
+
+   /* Empty files never reclaim anything. */
+   if (s->st_size == 0)
+      return;
+
+   if (dupeCount == dupeMax)
+   {
+      dupeMax = (dupeMax) ? dupeMax * 2 : 1024;
+      if ((dupes = (DUPE*)realloc(dupes, dupeMax * sizeof(DUPE))) == NULL)
+      {
+         fprintf(stderr, "Out of memory collecting duplicate candidates\n");
+         exit(1);
+      }
+   }
+
+   d = &dupes[dupeCount++];
+   d->path = (char*)malloc(strlen(dir) + strlen(name) + 2);
+   sprintf(d->path, "%s/%s", dir, name);
+   d->size = s->st_size;
+   d->dev = s->st_dev;
+   d->ino = s->st_ino;
+   d->hash = 0;
+   d->isBad = false;
+}
+
+static ul64 mixSize(ul64 size)
+{
+   size ^= size >> 33;
+   size *= 0xFF51AFD7ED558CCDULL;
+   size ^= size >> 33;
+   return size;
+}
+
+/* Count how many files share each size, using an open addressed table. */
+/* Files with a unique size are marked bad, since they can't be dupes. */
+static void dropUniqueSizes(void)
+{
+   SIZESLOT   *table;
+   ul64       slots = 16,
+              mask,
+              x, h;
+
+   while (slots < dupeCount * 2)
+      slots <<= 1;
+   mask = slots - 1;
+
+   if ((table = (SIZESLOT*)calloc(slots, sizeof(SIZESLOT))) == NULL)
+   {
+      fprintf(stderr, "Out of memory grouping file sizes\n");
+      exit(1);
+   }
+
+   for (x = 0; x < dupeCount; x++)
+   {
+      for (h = mixSize(dupes[x].size) & mask;
+           table[h].count && table[h].size != dupes[x].size;
+           h = (h + 1) & mask)
+         ;
+      table[h].size = dupes[x].size;
+      table[h].count++;
+   }
+
+   for (x = 0; x < dupeCount; x++)
+   {
+      for (h = mixSize(dupes[x].size) & mask;
+           table[h].size != dupes[x].size;
+           h = (h + 1) & mask)
+         ;
+      if (table[h].count < 2)
+         dupes[x].isBad = true;
+   }
+
+   free(table);
+}
+
+/* Move all the good entries to the front, returns the new count. */
+static ul64 compact(void)
+{
+   ul64   x, y;
+
+   for (x = y = 0; x < dupeCount; x++)
+   {
+      if (dupes[x].isBad)
+         free(dupes[x].path);
+      else
+         dupes[y++] = dupes[x];
+   }
+
+   return (dupeCount = y);
+}
+
+static int cmpInode(const void *a, const void *b)
+{
+   const DUPE   *da = (const DUPE*)a,
+                *db = (const DUPE*)b;
+
+   if (da->size != db->size)
+      return (da->size < db->size) ? -1 : 1;
+   if (da->dev != db->dev)
+      return (da->dev < db->dev) ? -1 : 1;
+   if (da->ino != db->ino)
+      return (da->ino < db->ino) ? -1 : 1;
+   return strcmp(da->path, db->path);
+}
+
+static int cmpHash(const void *a, const void *b)
+{
+   const DUPE   *da = (const DUPE*)a,
+                *db = (const DUPE*)b;
+
+   if (da->size != db->size)
+      return (da->size > db->size) ? -1 : 1;
+   if (da->hash != db->hash)
+      return (da->hash < db->hash) ? -1 : 1;
+   return strcmp(da->path, db->path);
+}
+
+/* Mark entries that don't share (size, hash) with a neighbour as bad. */
+/* The list must be sorted with cmpHash first. */
+static void dropUniqueHashes(void)
+{
+   ul64   x, y;
+
+   for (x = 0; x < dupeCount; x = y)
+   {
+      for (y = x + 1; y < dupeCount &&
+                      dupes[y].size == dupes[x].size &&
+                      dupes[y].hash == dupes[x].hash; y++)
+         ;
+      if (y - x < 2)
+         dupes[x].isBad = true;
+   }
+}
+
+static bool readAll(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+   ssize_t   got;
+
+   while (len > 0)
+   {
+      if ((got = pread(fd, buf, len, offset)) <= 0)
+      {
+         if (got < 0 && errno == EINTR)
+            continue;
+         return false;
+      }
+      buf += got;
+      len -= got;
+      offset += got;
+   }
+
+   return true;
+}
+
+/* Hash the first and last PART_SIZE bytes. Small files get hashed whole. */
+static void partialHash(DUPE *d)
+{
+   unsigned char   buf[PART_SIZE];
+   size_t          len = (d->size < PART_SIZE) ? d->size : PART_SIZE;
+   int             fd;
+
+   if ((fd = open(d->path, O_RDONLY)) < 0)
+   {
+      fprintf(stderr, "Could not open file: %s [%s]\n", d->path, strerror(errno));
+      d->isBad = true;
+      return;
+   }
+
+   if (readAll(fd, buf, len, 0))
+   {
+      d->hash = hashBytes(buf, len, d->size);
+
+      if (d->size > PART_SIZE)
+      {
+         off_t   tail = (d->size > 2 * PART_SIZE) ? d->size - PART_SIZE : PART_SIZE;
+
+         len = d->size - tail;
+         if (readAll(fd, buf, len, tail))
+            d->hash = hashBytes(buf, len, d->hash);
+         else
+            d->isBad = true;
+      }
+   }
+   else
+      d->isBad = true;
+
+   close(fd);
+}
+
+/* Hash the whole file in CHUNK_SIZE pieces, chaining each into the next. */
+/* Uses mmap when it can, otherwise large aligned reads. */
+static void fullHash(DUPE *d)
+{
+   ul64            hash = d->size,
+                   done;
+   unsigned char   *map;
+   STAT            s;
+   int             fd;
+
+   if ((fd = open(d->path, O_RDONLY)) < 0)
+   {
+      fprintf(stderr, "Could not open file: %s [%s]\n", d->path, strerror(errno));
+      d->isBad = true;
+      return;
+   }
+
+   /* A file that changed since the search could fault under mmap. */
+   if (fstat(fd, &s) != 0 || (ul64)s.st_size != d->size)
+   {
+      d->isBad = true;
+      close(fd);
+      return;
+   }
+
+   map = (unsigned char*)mmap(NULL, d->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+   if (map != MAP_FAILED)
+   {
+      madvise(map, d->size, MADV_SEQUENTIAL);
+
+      for (done = 0; done < d->size; done += CHUNK_SIZE)
+      {
+         size_t   len = (d->size - done < CHUNK_SIZE) ? d->size - done : CHUNK_SIZE;
+
+         hash = hashBytes(map + done, len, hash);
+      }
+      munmap(map, d->size);
+   }
+   else
+   {
+      void   *buf;
+
+      if (posix_memalign(&buf, PART_SIZE, CHUNK_SIZE) != 0)
+      {
+         fprintf(stderr, "Out of memory hashing file: %s\n", d->path);
+         d->isBad = true;
+         close(fd);
+         return;
+      }
+
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+      for (done = 0; done < d->size; done += CHUNK_SIZE)
+      {
+         size_t   len = (d->size - done < CHUNK_SIZE) ? d->size - done : CHUNK_SIZE;
+
+         if (!readAll(fd, (unsigned char*)buf, len, done))
+         {
+            d->isBad = true;
+            break;
+         }
+         hash = hashBytes(buf, len, hash);
+      }
+      free(buf);
+   }
+
+   d->hash = hash;
+   close(fd);
+}
+
+static void *poolThread(void *arg)
+{
+   POOL   *pool = (POOL*)arg;
+   ul64   x;
+
+   for (;;)
+   {
+      pthread_mutex_lock(&pool->lock);
+      x = pool->next++;
+      pthread_mutex_unlock(&pool->lock);
+
+      if (x >= pool->count)
+         break;
+
+      pool->work(&pool->list[x]);
+   }
+
+   return NULL;
+}
+
+/* Run 'work' over every entry, spread across the available CPUs. */
+static void runPool(DUPE *list, ul64 count, void (*work)(DUPE *))
+{
+   pthread_t   threads[MAX_THREADS];
+   POOL        pool;
+   long        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   int         nThreads,
+               x;
+
+   /* Hashing mostly waits on I/O, so use a few more threads than CPUs. */
+   nThreads = (cpus > 0) ? cpus * 2 : 2;
+   if (nThreads > MAX_THREADS)
+      nThreads = MAX_THREADS;
+   if ((ul64)nThreads > count)
+      nThreads = count;
+
+   pool.list = list;
+   pool.count = count;
+   pool.next = 0;
+   pool.work = work;
+   pthread_mutex_init(&pool.lock, NULL);
+
+   for (x = 0; x < nThreads; x++)
+   {
+      if (pthread_create(&threads[x], NULL, poolThread, &pool) != 0)
+         break;
+   }
+
+   /* If no threads could start, do it all here. */
+   if (x == 0)
+      poolThread(&pool);
+
+   while (x-- > 0)
+      pthread_join(threads[x], NULL);
+
+   pthread_mutex_destroy(&pool.lock);
+}
+
+/* Most reclaimable bytes first. */
+static int cmpGroup(const void *a, const void *b)
+{
+   const GROUP   *ga = (const GROUP*)a,
+                 *gb = (const GROUP*)b;
+
+   if (ga->reclaim != gb->reclaim)
+      return (ga->reclaim > gb->reclaim) ? -1 : 1;
+   return (ga->first < gb->first) ? -1 : 1;
+}
+
+static void printGroup(GROUP *g)
+{
+   ul64   x;
+
+   printf("%12Ld bytes reclaimable (%Ld bytes x %Ld copies)\n",
+          g->reclaim, dupes[g->first].size, g->last - g->first);
+
+   for (x = g->first; x < g->last; x++)
+      printf("   %s\n", dupes[x].path);
+}
+
+void dupesReport(void)
+{
+   GROUP  *groups;
+   ul64   x, y,
+          groupCount = 0,
+          reclaim = 0;
+   double scaled;
+   char   scaleChr;
+
+   dropUniqueSizes();
+   compact();
+
+   /* Hard links to one inode share their storage, so keep just one. */
+   qsort(dupes, dupeCount, sizeof(DUPE), cmpInode);
+   for (x = 1; x < dupeCount; x++)
+   {
+      if (dupes[x].dev == dupes[x-1].dev && dupes[x].ino == dupes[x-1].ino)
+         dupes[x].isBad = true;
+   }
+   compact();
+   dropUniqueSizes();
+   compact();
+
+   /* First pass: the ends of each file. */
+   runPool(dupes, dupeCount, partialHash);
+   compact();
+   qsort(dupes, dupeCount, sizeof(DUPE), cmpHash);
+   dropUniqueHashes();
+   compact();
+
+   /* Second pass: whole files, unless the first pass already read it all. */
+   for (x = y = 0; x < dupeCount; x++)
+   {
+      if (dupes[x].size > PART_SIZE * 2)
+      {
+         DUPE   temp = dupes[y];
+
+         dupes[y++] = dupes[x];
+         dupes[x] = temp;
+      }
+   }
+   runPool(dupes, y, fullHash);
+   compact();
+   qsort(dupes, dupeCount, sizeof(DUPE), cmpHash);
+   dropUniqueHashes();
+   compact();
+
+   /* Every group has at least two entries, so this is plenty. */
+   if ((groups = (GROUP*)malloc((dupeCount / 2 + 1) * sizeof(GROUP))) == NULL)
+   {
+      fprintf(stderr, "Out of memory reporting duplicates\n");
+      exit(1);
+   }
+
+   for (x = 0; x < dupeCount; x = y)
+   {
+      for (y = x + 1; y < dupeCount &&
+                      dupes[y].size == dupes[x].size &&
+                      dupes[y].hash == dupes[x].hash; y++)
+         ;
+      groups[groupCount].first = x;
+      groups[groupCount].last = y;
+      groups[groupCount].reclaim = dupes[x].size * (y - x - 1);
+      reclaim += groups[groupCount++].reclaim;
+   }
+   qsort(groups, groupCount, sizeof(GROUP), cmpGroup);
+
+   printf("Duplicate files:\n\n");
+   for (x = 0; x < groupCount; x++)
+      printGroup(&groups[x]);
+
+   scaled = scaleCount(reclaim, &scaleChr);
+   printf("\n%012Ld (%.1f%c) reclaimable bytes in %Ld duplicate group(s)\n\n",
+          reclaim, scaled, scaleChr, groupCount);
+
+   free(groups);
+
+   for (x = 0; x < dupeCount; x++)
+      free(dupes[x].path);
+   free(dupes);
+   dupes = NULL;
+   dupeCount = dupeMax = 0;
+}
+
+/* dupes.c */
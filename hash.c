@@ -0,0 +1,108 @@
+/*  hash.c
+ *
+ *  Copyright 2018 Steven Anthony (Tony) Williams
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "hbs.h"
+
+/* A fast non-cryptographic 64 bit hash. Four independent lanes eat */
+/* 32 bytes per round so the multiplies can overlap. Not for security. */
+#define  PRIME1             0x9E3779B185EBCA87ULL
+#define  PRIME2             0xC2B2AE3D27D4EB4FULL
+#define  PRIME3             0x165667B19E3779F9ULL
+#define  PRIME4             0x85EBCA77C2B2AE63ULL
+#define  PRIME5             0x27D4EB2F165667C5ULL
+
+#define  Rotl(x, r)         (((x) << (r)) | ((x) >> (64 - (r))))
+
+static ul64 round64(ul64 acc, ul64 k)
+{
+   acc += k * PRIME2;
+   acc = Rotl(acc, 31);
+   return acc * PRIME1;
+}
+
+static ul64 merge64(ul64 h, ul64 acc)
+{
+   h ^= round64(0, acc);
+   return h * PRIME1 + PRIME4;
+}
+
+static ul64 read64(const unsigned char *p)
+{
+   ul64   k;
+
+   memcpy(&k, p, 8);
+   return k;
+}
+
+/* Hash 'len' bytes. Chain calls by passing the last result as 'seed'. */
+ul64 hashBytes(const void *data, size_t len, ul64 seed)
+{
+   const unsigned char   *ptr = (const unsigned char*)data;
+   const unsigned char   *end = ptr + len;
+   ul64                  h;
+
+   if (len >= 32)
+   {
+      ul64   v1 = seed + PRIME1 + PRIME2,
+             v2 = seed + PRIME2,
+             v3 = seed,
+             v4 = seed - PRIME1;
+
+      for (; ptr + 32 <= end; ptr += 32)
+      {
+         v1 = round64(v1, read64(ptr));
+         v2 = round64(v2, read64(ptr+8));
+         v3 = round64(v3, read64(ptr+16));
+         v4 = round64(v4, read64(ptr+24));
+      }
+
+      h = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+      h = merge64(h, v1);
+      h = merge64(h, v2);
+      h = merge64(h, v3);
+      h = merge64(h, v4);
+   }
+   else
+      h = seed + PRIME5;
+
+   h += (ul64)len;
+
+   for (; ptr + 8 <= end; ptr += 8)
+   {
+      h ^= round64(0, read64(ptr));
+      h = Rotl(h, 27) * PRIME1 + PRIME4;
+   }
+
+   for (; ptr < end; ptr++)
+   {
+      h ^= (*ptr) * PRIME5;
+      h = Rotl(h, 11) * PRIME1;
+   }
+
+   /* Final avalanche */
+   h ^= h >> 33;
+   h *= PRIME2;
+   h ^= h >> 29;
+   h *= PRIME3;
+   h ^= h >> 32;
+
+   return h;
+}
+
+/* hash.c */
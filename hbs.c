@@ -19,12 +19,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <dirent.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <getopt.h>
-#include <fnmatch.h>
 #include <errno.h>
+#include "hbs.h"
 
 #define V_MAJOR 1
 #define V_MINOR 0
@@ -64,11 +63,14 @@
 #define  OPT_EXTENSION      0x00080000    /* Extend command mode */
 #define  OPT_BACKGRND       0x00100000    /* Execute command in background */
 #define  OPT_DUMP           0x00200000    /* Dump the path (verbose without count) */
+#define  OPT_DUPES          0x00400000    /* Report duplicate regular files */
+#define  OPT_SNAPSHOT       0x00800000    /* Write a snapshot of files counted */
+#define  OPT_DIFF           0x01000000    /* Compare two snapshots */
 #define  OPT_DEFAULT        NO_OPTMASK    /* Default options */
 
-#define  OPT_STRING         "ANLKREDYCVBOFISTbc:e:ghi:j:lpruvdtf:x:"
+#define  OPT_STRING         "ANLKREDYCVBOFISTa:bc:e:ghi:j:lo:pq:ruvdms:z:tf:x:"
 /* Remaining option letters */
-/* GHJMPQUWXZ adkmnoqswyz */
+/* GHJMPQUWXZ knwy */
 
 #define  SetMask(a, m)      (a | m)
 #define  ClearMask(a, m)    (a & ~m)
@@ -80,21 +82,6 @@
 #define  ClearMasks(m)      (m & MASK_NONE_PO)
 #define  CNT_MSG(a)         printf("Search path: %s\n", a)
 
-#define  K                  (1024.0)
-#define  MEG                (1024.0*1024.0)
-#define  GIG                (MEG*1024.0)
-
-#define  SMALL_BUF          80
-#define  BIG_BUF            256
-
-#ifndef __cplusplus
-enum                        { false = 0, true };
-typedef int                 bool;
-#endif
-
-typedef struct stat         STAT;
-typedef unsigned long long  ul64;
-
 extern int                  errno;
 
 static struct option        opts[] =
@@ -124,6 +111,12 @@ static struct option        opts[] =
    { "recursive", no_argument, 0, 'r' },
    { "verbose", no_argument, 0, 'v' },
    { "dump", no_argument, 0, 'd' },
+   { "dupes", no_argument, 0, 'm' },
+   { "snapshot", required_argument, 0, 's' },
+   { "diff", required_argument, 0, 'z' },
+   { "max_iops", required_argument, 0, 'q' },
+   { "max_in_flight", required_argument, 0, 'o' },
+   { "target_latency", required_argument, 0, 'a' },
    { "tree", no_argument, 0, 't' },
    { "follow_links", no_argument, 0, 'l' },
    { "permissions", no_argument, 0, 'p' },
@@ -179,7 +172,19 @@ static char                 *help[] =
    "                           NOTE: There are no checks for recursive links.",
    " -r, --recursive           Recurse to subdirectores",
    " -v, --verbose             Display each file counted and/or Cmd executed",
-   " -d, --dump                Dump the path (like verbose without count)\n",
+   " -d, --dump                Dump the path (like verbose without count)",
+   " -m, --dupes               Report duplicate regular files among those",
+   "                           counted, and the bytes they could reclaim",
+   " -sFile, --snapshot=File   Save the files counted to snapshot 'file'",
+   " -zFile, --diff=File       Compare snapshot 'file' to a later snapshot,",
+   "                           given as the only path (hbs -zOld New)\n",
+   " -qNum,  --max_iops=Num    At most 'num' file status reads per second",
+   " -oNum,  --max_in_flight=Num",
+   "                           Read up to 'num' file status at once (threads)",
+   " -aUsec, --target_latency=Usec",
+   "                           Raise or lower the number in flight to keep",
+   "                           file status reads near 'usec' microseconds",
+   "                           (up to -o, or 32). For busy network mounts.\n",
    " The following options are ignored unless -v or --verbose are used.\n",
    " -p, --permissions         Show file's permissions",
    " -u, --user_id             Show file's user ID",
@@ -198,6 +203,17 @@ static char                 *help[] =
    " Search for all '.o' files starting at '~/local/src'. Recurse to all",
    " subdirectories and execute 'rm' on each file found.\n",
    "       hbs -rf*.o ~/local/src -crm\n",
+   " Find duplicate files under your home directory, and how much space",
+   " removing the extra copies would save.\n",
+   "       hbs -rm ~\n",
+   " Save a snapshot of '/srv' tonight, another tomorrow, and see which",
+   " directories grew in between.\n",
+   "       hbs -r /srv -s/tmp/srv.old",
+   "       hbs -r /srv -s/tmp/srv.new",
+   "       hbs --diff=/tmp/srv.old /tmp/srv.new\n",
+   " Size a shared NFS mount gently: no more than 2000 reads a second, and",
+   " back off whenever they start taking more than 2 milliseconds.\n",
+   "       hbs -r /mnt/share -q2000 -a2000\n",
    " Search for symbolic links only in '/usr/lib' and be verbose. The -N",
    " turns everything off and the -L turns on symbolic links. Notice it only",
    " counts the size of the link and not the destination. Add the -l option",
@@ -206,19 +222,19 @@ static char                 *help[] =
    ""
 };
 
-/*static double   byteCount = 0.0;*/
-static ul64    byteCount = 0;
 static ul64    optBits = OPT_DEFAULT | MASK_DEFAULT,
-                fileCount = 0L,
-                dirCount = 0L,
                 modeBits = 0L;
+static unsigned maxIops = 0,
+                maxInFlight = 0,
+                targetLatency = 0;
 static char     filePattern[SMALL_BUF],
                 cmdString[SMALL_BUF],
                 cmdExtString[SMALL_BUF],
+                snapPath[BIG_BUF],
+                diffPath[BIG_BUF],
                 startPath[256];
 static bool     isHelp = false,
                 isFilter, isOr, isAnd, isXor,
-                isRecursive = false,
                 isVerbose = false,
                 isDump = false,
                 isPermissions = false,
@@ -227,7 +243,10 @@ static bool     isHelp = false,
                 isCmd = false,
                 isExt = false,
                 isBack = false,
-                isTree = false;
+                isTree = false,
+                isDupes = false,
+                isSnapshot = false,
+                isDiff = false;
 
 void loadStatus(STAT *s, char *fileStat)
 {
@@ -306,200 +325,104 @@ char *fix_filename(char *name)
    return out;
 }
 
-void search(char *path, int indent)
+/* Entry callback: show, run the command on, and collect each file counted. */
+int showEntry(const HBS_ENTRY *entry, void *data)
 {
-   DIR                  *dirPtr;
-   struct dirent        *dirEntry;
-   STAT                 statBuffer;
-   /*unsigned long long   statSize;*/
-   ul64                statSize;
-   char                 endChar,
-                        curPath[256],
-                        linkPath[SMALL_BUF];
-   bool                 countingFile,
-                        isDir;
-
-   if ((dirPtr = opendir(path)) == NULL)
-      fprintf(stderr, "Could not open directory: %s [%s]\n", path, strerror(errno));
-   else
-   {
-      char   fileStatus[SMALL_BUF];
-      bool   patternMatch,
-             orMatch, xorMatch,
-             andMatch, isMatch;
+   char   fileStatus[SMALL_BUF];
 
-      chdir(path);
-      getcwd(curPath, 256);
+   if (isVerbose | isDump)
+   {
+      loadStatus((STAT*)&entry->st, fileStatus);
 
-      while((dirEntry = readdir(dirPtr)) != NULL)
+      if (isTree)
       {
-         lstat(dirEntry->d_name, &statBuffer);
-         statSize = statBuffer.st_size;
-
-         if (isFilter)
-            patternMatch = (fnmatch(filePattern, dirEntry->d_name, 0)) ? false : true;
-         else
-            patternMatch = true;
-
-         if (isOr)
-            orMatch = (modeBits & (statBuffer.st_mode & 0777)) ? true : false;
-         else
-            orMatch = true;
-            
-         if (isXor)
-         {
-            ul64 bits = (statBuffer.st_mode & 0777);
-
-            if ((modeBits & bits) && !(~modeBits & bits))
-               xorMatch = true;
-            else
-               xorMatch = false;
-         }  
-         else
-            xorMatch = true;
-            
-         if (isAnd)
-         {
-            ul64 bits = (statBuffer.st_mode & 0777);
-            
-            if ((modeBits == (modeBits & bits)) && !(~modeBits & bits))
-               andMatch = true;
-            else
-               andMatch = false;
-         }  
-         else
-            andMatch = true;
-
-         isMatch = (patternMatch && orMatch && xorMatch && andMatch) ? true : false;
-            
-         linkPath[0] = '\0';
-         endChar = ' ';
-         isDir = false;
-
-         if (S_ISDIR(statBuffer.st_mode))
-         {
-            /* Ignore . and .. */
-            if (strcmp(".", dirEntry->d_name) == 0 ||
-                strcmp("..", dirEntry->d_name) == 0)
-               continue;
-
-            isDir = true;
-
-            if (isMatch && (countingFile = IsNot(optBits, MASK_DIR)))
-            {
-               endChar = '/';
-               dirCount++;
-            }
-         }
-         else if (S_ISLNK(statBuffer.st_mode))
-         {
-            countingFile = IsNot(optBits, MASK_SYMLINK);
-
-            if (countingFile)
-            {
-               STAT   tempStat;
-               bool   followLinks = Is(optBits, OPT_LINKS);
-
-               stat(dirEntry->d_name, &tempStat);
+         printf("%9Ld %s %*s%s%c\n", entry->size, fileStatus,
+                entry->depth * 3, "", entry->name, entry->endChar);
+      }
+      else if (isDump)
+      {
+         printf("%s/%s%c\n", entry->dir, entry->name, entry->endChar);
+      }
+      else
+      {
+         printf("%9Ld %s %s/%s%c\n", entry->size, fileStatus,
+                entry->dir, entry->name, entry->endChar);
+      }
+   }
 
-               if (followLinks)
-                  statSize = tempStat.st_size;
+   if (isCmd)
+   {
+      int          nf;
+      char         *sysCmd,
+                   newFile[SMALL_BUF],
+                   extCmd[BIG_BUF*2];
+      char         *ptr,
+                   *dir;
+      const char   *name = entry->name;
+
+      extCmd[0] = 0;
+
+      for (nf = 0; name[nf] && (name[nf] != '.') && (nf < SMALL_BUF-1); nf++)
+         newFile[nf] = name[nf];
+      newFile[nf] = 0;
+
+      if (isExt)
+         sprintf(extCmd, "%s/%s.%s", startPath, newFile, cmdExtString);
+
+      /* Put '\' before each white space or special char */
+      ptr = fix_filename((char*)name);
+      dir = fix_filename((char*)entry->dir);
+
+      /* The scan never changes directory, so the command does it. */
+      sysCmd = (char*)malloc(strlen(dir) + strlen(cmdString) + strlen(ptr) +
+                             strlen(extCmd) + 16);
+      sprintf(sysCmd, "cd %s && %s %s %s %s", dir, cmdString,
+              ptr,
+              extCmd,
+              (isBack) ? "&" : "");
+      free(ptr);
+      free(dir);
+
+      if (isVerbose | isDump)
+         printf("Cmd: %s\n", sysCmd);
+
+      system(sysCmd);
+      free(sysCmd);
+   }
 
-               /* See if it's a directory. */
-               if (S_ISDIR(tempStat.st_mode))
-               {
-                  if (followLinks)
-                     isDir = true;
+   if (isDupes && S_ISREG(entry->st.st_mode))
+      dupesAdd(entry->dir, entry->name, (STAT*)&entry->st);
 
-                  endChar = '/';
-                  dirCount++;
-               }
-/*
-               sprintf(linkPath, " -> %s%c", dirEntry->d_name, endChar);
-*/
-            }
-         }
-         else if (S_ISREG(statBuffer.st_mode))
-            countingFile = (isMatch && IsNot(optBits, MASK_REGFILE));
-         else if (S_ISCHR(statBuffer.st_mode))
-            countingFile = (isMatch && IsNot(optBits, MASK_CHARDEV));
-         else if (S_ISBLK(statBuffer.st_mode))
-            countingFile = (isMatch && IsNot(optBits, MASK_BLKDEV));
-         else if (S_ISFIFO(statBuffer.st_mode))
-            countingFile = (isMatch && IsNot(optBits, MASK_FIFO));
-         else if (S_ISSOCK(statBuffer.st_mode))
-            countingFile = (isMatch && IsNot(optBits, MASK_SOCKET));
-         else
-            countingFile = false;
+   if (isSnapshot)
+      snapAdd(entry->dir, entry->name, (STAT*)&entry->st);
 
-         if (countingFile && isMatch)
-         {
-            /*byteCount += (double)statSize;*/
-            byteCount += statSize;
-            fileCount++;
-
-            if (isVerbose | isDump)
-            {
-               loadStatus(&statBuffer, fileStatus);
-
-               if (isTree)
-               {
-                  printf("%9Ld %s %*s%s%c\n", statSize, fileStatus,
-                         indent, "", dirEntry->d_name, endChar);
-               }
-               else if (isDump)
-               {
-                  printf("%s/%s%c%s\n",
-                         curPath, dirEntry->d_name, endChar, linkPath);
-               }
-               else
-               {
-                  printf("%9Ld %s %s/%s%c%s\n", statSize, fileStatus,
-                         curPath, dirEntry->d_name, endChar, linkPath);
-               }
-            }
-
-            if (isCmd)
-            {
-               int    nf;
-               char   sysCmd[256],
-                      newFile[SMALL_BUF],
-                      extCmd[256];
-               char   *ptr = dirEntry->d_name;       
-
-               sysCmd[0] = 0;
-               extCmd[0] = 0;
-
-               for (nf = 0; (*(ptr+nf) != '.') && (nf < BIG_BUF); nf++)
-                  newFile[nf] = *(ptr+nf);
-               newFile[nf] = 0;
-
-               if (isExt)
-                  sprintf(extCmd, "%s/%s.%s", startPath, newFile, cmdExtString);
-
-               /* Put '\' before each white space or special char */
-               ptr = fix_filename(dirEntry->d_name);
-               sprintf(sysCmd, "%s %s %s %s", cmdString,
-                       ptr,
-                       extCmd,
-                       (isBack) ? "&" : "");
-               free(ptr);
-
-               if (isVerbose | isDump)
-                  printf("Cmd: %s\n", sysCmd);
-
-               system(sysCmd);
-            }
-         }
+   return 0;
+}
 
-         if (isDir && isRecursive)
-            search(dirEntry->d_name, indent+3);
+void showError(const char *path, int what, int err, void *data)
+{
+   if (what == HBS_ERR_OPENDIR)
+      fprintf(stderr, "Could not open directory: %s [%s]\n", path, strerror(err));
+   else
+      fprintf(stderr, "Could not read file status: %s [%s]\n", path, strerror(err));
+}
 
-         chdir(curPath);
-      }
-      chdir("..");
-      closedir(dirPtr);
+/* Scale a byte count to K, M or G for display. */
+double scaleCount(ul64 count, char *scaleChr)
+{
+   if (count < MEG)
+   {
+      *scaleChr = 'K';
+      return (double)(count / K);
+   }
+   else if (count < GIG)
+   {
+      *scaleChr = 'M';
+      return (double)(count / MEG);
    }
+
+   *scaleChr = 'G';
+   return (double)(count / GIG);
 }
 
 void printHelp()
@@ -616,6 +539,26 @@ int main(int argc, char *argv[])
          case 'd':
             optBits = SetOption(optBits, OPT_DUMP);
             break;
+         case 'm':
+            optBits = SetOption(optBits, OPT_DUPES);
+            break;
+         case 's':
+            optBits = SetOption(optBits, OPT_SNAPSHOT);
+            strncpy(snapPath, optarg, BIG_BUF - 1);
+            break;
+         case 'q':
+            maxIops = atoi(optarg);
+            break;
+         case 'o':
+            maxInFlight = atoi(optarg);
+            break;
+         case 'a':
+            targetLatency = atoi(optarg);
+            break;
+         case 'z':
+            optBits = SetOption(optBits, OPT_DIFF);
+            strncpy(diffPath, optarg, BIG_BUF - 1);
+            break;
          case 't':
             optBits = SetOption(optBits, OPT_TREE);
             break;
@@ -654,10 +597,12 @@ int main(int argc, char *argv[])
 
    if (!isHelp)
    {
-      double   scaled_count = 0.0;
-      char     scale_chr = 'G';
+      double       scaled_count = 0.0;
+      char         scale_chr = 'G';
+      HBS_FILTER   *filter;
+      HBS_SCAN     *scan;
+      HBS_TOTALS   totals;
 
-      isRecursive = Is(optBits, OPT_RECURSIVE);
       isVerbose = Is(optBits, OPT_VERBOSE);
       isDump = Is(optBits, OPT_DUMP);
       isTree = Is(optBits, OPT_TREE);
@@ -671,6 +616,38 @@ int main(int argc, char *argv[])
       isCmd = Is(optBits, OPT_COMMAND);
       isExt = Is(optBits, OPT_EXTENSION);
       isBack = Is(optBits, OPT_BACKGRND);
+      isDupes = Is(optBits, OPT_DUPES);
+      isSnapshot = Is(optBits, OPT_SNAPSHOT);
+      isDiff = Is(optBits, OPT_DIFF);
+
+      /* A diff only reads the two snapshots, there's no search. */
+      if (isDiff)
+      {
+         if (argc - optind == 1)
+            snapDiff(diffPath, argv[optind]);
+         else
+            printf("--diff needs two snapshots (hbs --diff=Old New).\n");
+
+         exit(0);
+      }
+
+      filter = hbsFilterCompile((isFilter) ? filePattern : NULL,
+                                optBits & MASK_ALL,
+                                ((isOr) ? HBS_MODE_OR : 0) |
+                                ((isAnd) ? HBS_MODE_AND : 0) |
+                                ((isXor) ? HBS_MODE_XOR : 0),
+                                modeBits);
+      scan = hbsScanNew(filter,
+                        ((Is(optBits, OPT_RECURSIVE)) ? HBS_RECURSIVE : 0) |
+                        ((Is(optBits, OPT_LINKS)) ? HBS_FOLLOW_LINKS : 0));
+      if (filter == NULL || scan == NULL ||
+          hbsScanThrottle(scan, maxIops, maxInFlight, targetLatency) != HBS_OK)
+      {
+         fprintf(stderr, "Out of memory starting search\n");
+         exit(1);
+      }
+      hbsScanOnEntry(scan, showEntry, NULL);
+      hbsScanOnError(scan, showError, NULL);
 
       if (isVerbose || isDump)
          printf("\n");
@@ -683,7 +660,7 @@ int main(int argc, char *argv[])
          if ((getcwd(cwdBuf, BIG_BUF)))
          {
             CNT_MSG(cwdBuf);
-            search(cwdBuf, 0);
+            hbsScan(scan, cwdBuf);
          }
          else
             printf("Could not read directory path: %s [%s]\n", cwdBuf, strerror(errno));
@@ -694,25 +671,24 @@ int main(int argc, char *argv[])
          for (; optind < argc; optind++)
          {
             CNT_MSG(argv[optind]);
-            search(argv[optind], 0);
+            hbsScan(scan, argv[optind]);
          }
       }
 
-      if (byteCount < MEG)
-      {
-         scaled_count = (double)(byteCount / K);
-         scale_chr = 'K';
-      }
-      else if (byteCount < GIG)
-      {
-         scaled_count = (double)(byteCount / MEG);
-         scale_chr = 'M';
-      }
-      else
-         scaled_count = (double)(byteCount / GIG);
+      hbsScanTotals(scan, &totals);
+      hbsScanFree(scan);
+      hbsFilterFree(filter);
+
+      scaled_count = scaleCount(totals.bytes, &scale_chr);
 
       printf("\n%012Ld (%.1f%c) total bytes in %Ld file(s) (%Ld are directories)\n\n",
-             byteCount, scaled_count, scale_chr, fileCount, dirCount);
+             totals.bytes, scaled_count, scale_chr, totals.files, totals.dirs);
+
+      if (isDupes)
+         dupesReport();
+
+      if (isSnapshot)
+         snapWrite(snapPath);
 /*
       printf("\n%09Ld total bytes in %Ld file(s) (%Ld are directories)\n\n",
              byteCount, fileCount, dirCount);
@@ -0,0 +1,67 @@
+/*  hbs.h
+ *
+ *  Copyright 2018 Steven Anthony (Tony) Williams
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef HBS_H
+#define HBS_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include "libhbs.h"
+
+#define  K                  (1024.0)
+#define  MEG                (1024.0*1024.0)
+#define  GIG                (MEG*1024.0)
+
+#define  SMALL_BUF          80
+#define  BIG_BUF            256
+
+#ifndef __cplusplus
+enum                        { false = 0, true };
+typedef int                 bool;
+#endif
+
+typedef struct stat         STAT;
+typedef unsigned long long  ul64;
+
+/* hbs.c */
+double scaleCount(ul64 count, char *scaleChr);
+
+/* hash.c */
+ul64 hashBytes(const void *data, size_t len, ul64 seed);
+
+/* dupes.c */
+void dupesAdd(const char *dir, const char *name, STAT *s);
+void dupesReport(void);
+
+/* throttle.c */
+typedef struct THROTTLE     THROTTLE;
+THROTTLE *throttleNew(unsigned maxIops, unsigned maxInFlight, unsigned targetUsec);
+void throttleFree(THROTTLE *t);
+bool throttleIsParallel(THROTTLE *t);
+void throttleWait(THROTTLE *t);
+bool throttleStatAll(THROTTLE *t, int dirfd, char **names, STAT *stats,
+                     int *errs, size_t count);
+
+/* snapshot.c */
+void snapAdd(const char *dir, const char *name, STAT *s);
+void snapWrite(const char *path);
+void snapDiff(const char *before, const char *after);
+
+#endif
+
+/* hbs.h */
@@ -0,0 +1,667 @@
+/*  libhbs.c
+ *
+ *  Copyright 2018 Steven Anthony (Tony) Williams
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <errno.h>
+#include "hbs.h"
+
+#define  ARENA_SIZE         65536         /* Batch string space */
+#define  DEFAULT_BATCH      256
+#define  STAT_CHUNK         256           /* Names lstat'ed together */
+#define  NAME_SIZE          256           /* Longest name + 1 */
+
+/* How a name pattern gets matched. */
+enum { MATCH_ANY, MATCH_LITERAL, MATCH_SUFFIX, MATCH_GLOB };
+
+struct HBS_FILTER
+{
+   char       *pattern;
+   const char *suffix;       /* Pattern after the leading '*' */
+   size_t     suffixLen;
+   int        match;
+   unsigned   skipTypes,
+              modeTests;
+   ul64       modeBits;
+};
+
+/* Names and lstat() results for one chunk of one directory. Each depth */
+/* gets its own, since a chunk is still in use while its subdirectories */
+/* are read. */
+typedef struct
+{
+   char    *names[STAT_CHUNK];
+   char    *nameBuf;
+   STAT    *stats;
+   int     errs[STAT_CHUNK];
+} LEVEL;
+
+struct HBS_SCAN
+{
+   const HBS_FILTER  *filter;
+   unsigned          flags;
+   HBS_ENTRY_FN      onEntry;
+   void              *entryData;
+   HBS_BATCH_FN      onBatch;
+   void              *batchData;
+   HBS_ERROR_FN      onError;
+   void              *errorData;
+
+   /* Pending batch, and the arena its strings live in. */
+   HBS_ENTRY         *batch;
+   size_t            batchCount,
+                     batchSize;
+   char              *arena;
+   size_t            arenaUsed,
+                     arenaSize;
+   const char        *batchDir;    /* Arena copy of path, NULL if stale */
+
+   /* Path of the directory being read. */
+   char              *path;
+   size_t            pathLen,
+                     pathMax;
+
+   /* Metadata load limits, NULL for none. */
+   THROTTLE          *throttle;
+   LEVEL             **levels;
+   int               levelMax;
+
+   HBS_TOTALS        totals;
+   bool              isStopped;
+};
+
+static void walk(HBS_SCAN *scan, int fd, int depth);
+
+HBS_FILTER *hbsFilterCompile(const char *pattern, unsigned skipTypes,
+                             unsigned modeTests, unsigned modeBits)
+{
+   HBS_FILTER   *f;
+
+   if ((f = (HBS_FILTER*)calloc(1, sizeof(HBS_FILTER))) == NULL)
+      return NULL;
+
+   f->skipTypes = skipTypes & HBS_SKIP_ALL;
+   f->modeTests = modeTests;
+   f->modeBits = modeBits & 0777;
+   f->match = MATCH_ANY;
+
+   if (pattern)
+   {
+      if ((f->pattern = strdup(pattern)) == NULL)
+      {
+         free(f);
+         return NULL;
+      }
+
+      /* Most patterns are a plain name or '*.ext', which need no fnmatch. */
+      if (strpbrk(pattern, "*?[\\") == NULL)
+         f->match = MATCH_LITERAL;
+      else if (pattern[0] == '*' && strpbrk(pattern + 1, "*?[\\") == NULL)
+      {
+         f->match = MATCH_SUFFIX;
+         f->suffix = f->pattern + 1;
+         f->suffixLen = strlen(f->suffix);
+      }
+      else
+         f->match = MATCH_GLOB;
+   }
+
+   return f;
+}
+
+void hbsFilterFree(HBS_FILTER *filter)
+{
+   if (filter)
+   {
+      free(filter->pattern);
+      free(filter);
+   }
+}
+
+static bool nameMatch(const HBS_FILTER *f, const char *name)
+{
+   size_t   len;
+
+   switch (f->match)
+   {
+      case MATCH_LITERAL:
+         return (strcmp(f->pattern, name) == 0);
+      case MATCH_SUFFIX:
+         len = strlen(name);
+         return (len >= f->suffixLen &&
+                 memcmp(name + len - f->suffixLen, f->suffix, f->suffixLen) == 0);
+      case MATCH_GLOB:
+         return (fnmatch(f->pattern, name, 0) == 0);
+      default:
+         return true;
+   }
+}
+
+static bool modeMatch(const HBS_FILTER *f, mode_t mode)
+{
+   ul64   bits = (mode & 0777);
+
+   if ((f->modeTests & HBS_MODE_OR) && !(f->modeBits & bits))
+      return false;
+
+   if ((f->modeTests & HBS_MODE_XOR) &&
+       !((f->modeBits & bits) && !(~f->modeBits & bits)))
+      return false;
+
+   if ((f->modeTests & HBS_MODE_AND) &&
+       !((f->modeBits == (f->modeBits & bits)) && !(~f->modeBits & bits)))
+      return false;
+
+   return true;
+}
+
+HBS_SCAN *hbsScanNew(const HBS_FILTER *filter, unsigned flags)
+{
+   HBS_SCAN   *scan;
+
+   if ((scan = (HBS_SCAN*)calloc(1, sizeof(HBS_SCAN))) == NULL)
+      return NULL;
+
+   scan->filter = filter;
+   scan->flags = flags;
+   scan->pathMax = PATH_MAX;
+
+   if ((scan->path = (char*)malloc(scan->pathMax)) == NULL)
+   {
+      free(scan);
+      return NULL;
+   }
+
+   return scan;
+}
+
+void hbsScanOnEntry(HBS_SCAN *scan, HBS_ENTRY_FN fn, void *data)
+{
+   scan->onEntry = fn;
+   scan->entryData = data;
+}
+
+void hbsScanOnBatch(HBS_SCAN *scan, HBS_BATCH_FN fn, size_t batchSize, void *data)
+{
+   scan->onBatch = fn;
+   scan->batchData = data;
+   scan->batchSize = (batchSize) ? batchSize : DEFAULT_BATCH;
+   scan->batchCount = 0;
+
+   free(scan->batch);
+   scan->batch = NULL;
+   if (fn)
+      scan->batch = (HBS_ENTRY*)malloc(scan->batchSize * sizeof(HBS_ENTRY));
+}
+
+void hbsScanOnError(HBS_SCAN *scan, HBS_ERROR_FN fn, void *data)
+{
+   scan->onError = fn;
+   scan->errorData = data;
+}
+
+int hbsScanThrottle(HBS_SCAN *scan, unsigned maxIops, unsigned maxInFlight,
+                    unsigned targetUsec)
+{
+   throttleFree(scan->throttle);
+   scan->throttle = NULL;
+
+   if (maxIops || maxInFlight > 1 || targetUsec)
+   {
+      if ((scan->throttle = throttleNew(maxIops, maxInFlight, targetUsec)) == NULL)
+         return HBS_ERROR;
+   }
+
+   return HBS_OK;
+}
+
+void hbsScanTotals(const HBS_SCAN *scan, HBS_TOTALS *totals)
+{
+   *totals = scan->totals;
+}
+
+void hbsScanFree(HBS_SCAN *scan)
+{
+   if (scan)
+   {
+      int   x;
+
+      for (x = 0; x < scan->levelMax; x++)
+      {
+         if (scan->levels[x])
+         {
+            free(scan->levels[x]->nameBuf);
+            free(scan->levels[x]->stats);
+            free(scan->levels[x]);
+         }
+      }
+      free(scan->levels);
+      throttleFree(scan->throttle);
+      free(scan->batch);
+      free(scan->arena);
+      free(scan->path);
+      free(scan);
+   }
+}
+
+static void scanError(HBS_SCAN *scan, const char *name, int what, int err)
+{
+   scan->totals.errors++;
+
+   if (scan->onError == NULL)
+      return;
+
+   if (name)
+   {
+      size_t   len = scan->pathLen;
+
+      /* Borrow the path buffer to name the entry, then put it back. */
+      if (len + strlen(name) + 2 <= scan->pathMax)
+      {
+         sprintf(scan->path + len, "/%s", name);
+         scan->onError(scan->path, what, err, scan->errorData);
+         scan->path[len] = '\0';
+         return;
+      }
+   }
+
+   scan->onError(scan->path, what, err, scan->errorData);
+}
+
+static void flushBatch(HBS_SCAN *scan)
+{
+   if (scan->batchCount && scan->onBatch)
+   {
+      if (scan->onBatch(scan->batch, scan->batchCount, scan->batchData))
+         scan->isStopped = true;
+   }
+
+   scan->batchCount = 0;
+   scan->arenaUsed = 0;
+   scan->batchDir = NULL;
+}
+
+/* Copy 'len' bytes into the arena. The caller has made room already. */
+static const char *arenaCopy(HBS_SCAN *scan, const char *str, size_t len)
+{
+   char   *out = scan->arena + scan->arenaUsed;
+
+   memcpy(out, str, len + 1);
+   scan->arenaUsed += len + 1;
+
+   return out;
+}
+
+static void addBatch(HBS_SCAN *scan, HBS_ENTRY *entry)
+{
+   size_t   nameLen = strlen(entry->name),
+            need = nameLen + 1 + ((scan->batchDir) ? 0 : scan->pathLen + 1);
+   HBS_ENTRY   *out;
+
+   if (scan->batchCount == scan->batchSize ||
+       scan->arenaUsed + need > scan->arenaSize)
+   {
+      flushBatch(scan);
+      need = nameLen + 1 + scan->pathLen + 1;
+   }
+
+   /* An empty arena can safely move. */
+   if (need > scan->arenaSize)
+   {
+      size_t   size = (need > ARENA_SIZE) ? need : ARENA_SIZE;
+      char     *arena = (char*)realloc(scan->arena, size);
+
+      if (arena == NULL)
+      {
+         scanError(scan, entry->name, HBS_ERR_STAT, ENOMEM);
+         return;
+      }
+      scan->arena = arena;
+      scan->arenaSize = size;
+   }
+
+   if (scan->batchDir == NULL)
+      scan->batchDir = arenaCopy(scan, scan->path, scan->pathLen);
+
+   out = &scan->batch[scan->batchCount++];
+   *out = *entry;
+   out->dir = scan->batchDir;
+   out->name = arenaCopy(scan, entry->name, nameLen);
+}
+
+static void countEntry(HBS_SCAN *scan, const char *name, STAT *st,
+                       ul64 size, int depth, char endChar)
+{
+   HBS_ENTRY   entry;
+
+   scan->totals.bytes += size;
+   scan->totals.files++;
+
+   if (scan->onEntry == NULL && scan->onBatch == NULL)
+      return;
+
+   entry.dir = scan->path;
+   entry.name = name;
+   entry.st = *st;
+   entry.size = size;
+   entry.depth = depth;
+   entry.endChar = endChar;
+
+   if (scan->onEntry && scan->onEntry(&entry, scan->entryData))
+      scan->isStopped = true;
+
+   if (scan->onBatch && scan->batch)
+      addBatch(scan, &entry);
+}
+
+/* Add "/name" to the path. Returns false if it can't grow. */
+static bool pushPath(HBS_SCAN *scan, const char *name)
+{
+   size_t   len = strlen(name),
+            need = scan->pathLen + len + 2;
+
+   if (need > scan->pathMax)
+   {
+      char   *path = (char*)realloc(scan->path, need * 2);
+
+      if (path == NULL)
+         return false;
+      scan->path = path;
+      scan->pathMax = need * 2;
+   }
+
+   /* The root is the only path that already ends in '/'. */
+   if (scan->pathLen == 0 || scan->path[scan->pathLen-1] != '/')
+      scan->path[scan->pathLen++] = '/';
+   memcpy(scan->path + scan->pathLen, name, len + 1);
+   scan->pathLen += len;
+   scan->batchDir = NULL;
+
+   return true;
+}
+
+static void popPath(HBS_SCAN *scan, size_t len)
+{
+   scan->pathLen = len;
+   scan->path[len] = '\0';
+   scan->batchDir = NULL;
+}
+
+/* Count entry 'name' of directory 'fd' (the current path), given its */
+/* lstat(), and recurse into it if it's a directory. */
+static void visit(HBS_SCAN *scan, int fd, const char *name, STAT *statBuffer,
+                  int depth)
+{
+   const HBS_FILTER   *f = scan->filter;
+   ul64               statSize = statBuffer->st_size;
+   char               endChar = ' ';
+   bool               countingFile = false,
+                      isDir = false,
+                      isMatch;
+
+   isMatch = nameMatch(f, name) && modeMatch(f, statBuffer->st_mode);
+
+   if (S_ISDIR(statBuffer->st_mode))
+   {
+      isDir = true;
+
+      if (isMatch && (countingFile = !(f->skipTypes & HBS_SKIP_DIR)))
+      {
+         endChar = '/';
+         scan->totals.dirs++;
+      }
+   }
+   else if (S_ISLNK(statBuffer->st_mode))
+   {
+      countingFile = !(f->skipTypes & HBS_SKIP_SYMLINK);
+
+      if (countingFile)
+      {
+         STAT   tempStat;
+         bool   followLinks = (scan->flags & HBS_FOLLOW_LINKS) ? true : false;
+
+         if (scan->throttle)
+            throttleWait(scan->throttle);
+
+         /* Dangling links keep their own size. */
+         if (fstatat(fd, name, &tempStat, 0) == 0)
+         {
+            if (followLinks)
+               statSize = tempStat.st_size;
+
+            /* See if it's a directory. */
+            if (S_ISDIR(tempStat.st_mode))
+            {
+               if (followLinks)
+                  isDir = true;
+
+               endChar = '/';
+               scan->totals.dirs++;
+            }
+         }
+      }
+   }
+   else if (S_ISREG(statBuffer->st_mode))
+      countingFile = (isMatch && !(f->skipTypes & HBS_SKIP_REGFILE));
+   else if (S_ISCHR(statBuffer->st_mode))
+      countingFile = (isMatch && !(f->skipTypes & HBS_SKIP_CHARDEV));
+   else if (S_ISBLK(statBuffer->st_mode))
+      countingFile = (isMatch && !(f->skipTypes & HBS_SKIP_BLKDEV));
+   else if (S_ISFIFO(statBuffer->st_mode))
+      countingFile = (isMatch && !(f->skipTypes & HBS_SKIP_FIFO));
+   else if (S_ISSOCK(statBuffer->st_mode))
+      countingFile = (isMatch && !(f->skipTypes & HBS_SKIP_SOCKET));
+
+   if (countingFile && isMatch)
+      countEntry(scan, name, statBuffer, statSize, depth, endChar);
+
+   if (isDir && (scan->flags & HBS_RECURSIVE) && !scan->isStopped)
+   {
+      size_t   len = scan->pathLen;
+      int      sub,
+               flags = O_RDONLY | O_DIRECTORY;
+
+      /* Only a link found by lstat() may be followed. */
+      if (S_ISDIR(statBuffer->st_mode))
+         flags |= O_NOFOLLOW;
+
+      if (!pushPath(scan, name))
+         scanError(scan, name, HBS_ERR_OPENDIR, ENAMETOOLONG);
+      else
+      {
+         if (scan->throttle)
+            throttleWait(scan->throttle);
+
+         if ((sub = openat(fd, name, flags)) < 0)
+            scanError(scan, NULL, HBS_ERR_OPENDIR, errno);
+         else
+            walk(scan, sub, depth + 1);
+         popPath(scan, len);
+      }
+   }
+}
+
+static bool isDots(const char *name)
+{
+   return (name[0] == '.' &&
+           (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')));
+}
+
+/* The chunk buffers for 'depth', made the first time it's reached. */
+static LEVEL *getLevel(HBS_SCAN *scan, int depth)
+{
+   LEVEL   *level;
+   int     x;
+
+   if (depth >= scan->levelMax)
+   {
+      int     max = (depth + 1) * 2;
+      LEVEL   **levels = (LEVEL**)realloc(scan->levels, max * sizeof(LEVEL*));
+
+      if (levels == NULL)
+         return NULL;
+      for (x = scan->levelMax; x < max; x++)
+         levels[x] = NULL;
+      scan->levels = levels;
+      scan->levelMax = max;
+   }
+
+   if ((level = scan->levels[depth]) == NULL &&
+       (level = (LEVEL*)calloc(1, sizeof(LEVEL))) != NULL)
+   {
+      level->nameBuf = (char*)malloc(STAT_CHUNK * NAME_SIZE);
+      level->stats = (STAT*)malloc(STAT_CHUNK * sizeof(STAT));
+      if (level->nameBuf == NULL || level->stats == NULL)
+      {
+         free(level->nameBuf);
+         free(level->stats);
+         free(level);
+         return NULL;
+      }
+      for (x = 0; x < STAT_CHUNK; x++)
+         level->names[x] = level->nameBuf + x * NAME_SIZE;
+      scan->levels[depth] = level;
+   }
+
+   return level;
+}
+
+/* Read the names of the open directory 'fd' STAT_CHUNK at a time, and */
+/* lstat each chunk across the throttle's thread pool. */
+static bool walkChunks(HBS_SCAN *scan, int fd, DIR *dirPtr, int depth)
+{
+   LEVEL           *level = getLevel(scan, depth);
+   struct dirent   *dirEntry = NULL;
+   size_t          count,
+                   x;
+
+   if (level == NULL)
+      return false;
+
+   do
+   {
+      for (count = 0; count < STAT_CHUNK &&
+                      (dirEntry = readdir(dirPtr)) != NULL; )
+      {
+         if (!isDots(dirEntry->d_name) && strlen(dirEntry->d_name) < NAME_SIZE)
+            strcpy(level->names[count++], dirEntry->d_name);
+      }
+
+      if (count && !throttleStatAll(scan->throttle, fd, level->names,
+                                    level->stats, level->errs, count))
+      {
+         /* No threads, so do it one at a time. */
+         for (x = 0; x < count; x++)
+         {
+            throttleWait(scan->throttle);
+            level->errs[x] = (fstatat(fd, level->names[x], &level->stats[x],
+                                      AT_SYMLINK_NOFOLLOW) != 0) ? errno : 0;
+         }
+      }
+
+      for (x = 0; x < count && !scan->isStopped; x++)
+      {
+         if (level->errs[x])
+            scanError(scan, level->names[x], HBS_ERR_STAT, level->errs[x]);
+         else
+            visit(scan, fd, level->names[x], &level->stats[x], depth);
+      }
+   } while (dirEntry != NULL && !scan->isStopped);
+
+   return true;
+}
+
+/* Read the open directory 'fd' (the current path), and maybe recurse. */
+/* Takes ownership of 'fd'. */
+static void walk(HBS_SCAN *scan, int fd, int depth)
+{
+   DIR             *dirPtr;
+   struct dirent   *dirEntry;
+   STAT            statBuffer;
+
+   if ((dirPtr = fdopendir(fd)) == NULL)
+   {
+      scanError(scan, NULL, HBS_ERR_OPENDIR, errno);
+      close(fd);
+      return;
+   }
+
+   if (scan->throttle && throttleIsParallel(scan->throttle) &&
+       walkChunks(scan, fd, dirPtr, depth))
+   {
+      closedir(dirPtr);
+      return;
+   }
+
+   while (!scan->isStopped && (dirEntry = readdir(dirPtr)) != NULL)
+   {
+      const char   *name = dirEntry->d_name;
+
+      /* Ignore . and .. */
+      if (isDots(name))
+         continue;
+
+      if (scan->throttle)
+         throttleWait(scan->throttle);
+
+      if (fstatat(fd, name, &statBuffer, AT_SYMLINK_NOFOLLOW) != 0)
+         scanError(scan, name, HBS_ERR_STAT, errno);
+      else
+         visit(scan, fd, name, &statBuffer, depth);
+   }
+
+   closedir(dirPtr);
+}
+
+int hbsScan(HBS_SCAN *scan, const char *path)
+{
+   char   *real;
+   int    fd = -1,
+          err;
+
+   if (scan->isStopped)
+      return HBS_STOPPED;
+
+   /* Report paths the way getcwd() would, absolute and resolved. */
+   popPath(scan, 0);
+   if ((real = realpath(path, NULL)) == NULL ||
+       !pushPath(scan, real + 1) ||
+       (fd = open(real, O_RDONLY | O_DIRECTORY)) < 0)
+   {
+      err = errno;
+      scan->totals.errors++;
+      if (scan->onError)
+         scan->onError(path, HBS_ERR_OPENDIR, err, scan->errorData);
+      free(real);
+      return HBS_ERROR;
+   }
+   free(real);
+
+   walk(scan, fd, 0);
+   flushBatch(scan);
+
+   return (scan->isStopped) ? HBS_STOPPED : HBS_OK;
+}
+
+/* libhbs.c */
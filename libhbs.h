@@ -0,0 +1,134 @@
+/*  libhbs.h
+ *
+ *  Copyright 2018 Steven Anthony (Tony) Williams
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * libhbs - the hbs directory scanner as a library.
+ *
+ * A filter is compiled once and can be shared by any number of scans. A
+ * scan holds all of its own state, so several can run at once, one per
+ * thread. Nothing here changes the working directory or prints anything.
+ *
+ *    HBS_FILTER   *f = hbsFilterCompile("*.log", HBS_SKIP_DIR, 0, 0);
+ *    HBS_SCAN     *s = hbsScanNew(f, HBS_RECURSIVE);
+ *    HBS_TOTALS   t;
+ *
+ *    hbsScanOnEntry(s, myEntryFn, myData);
+ *    hbsScan(s, "/var/log");
+ *    hbsScanTotals(s, &t);
+ *    hbsScanFree(s);
+ *    hbsFilterFree(f);
+ */
+
+#ifndef LIBHBS_H
+#define LIBHBS_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* File types to skip, for hbsFilterCompile(). */
+#define  HBS_SKIP_SYMLINK   0x00000001
+#define  HBS_SKIP_REGFILE   0x00000002
+#define  HBS_SKIP_DIR       0x00000004
+#define  HBS_SKIP_CHARDEV   0x00000008
+#define  HBS_SKIP_BLKDEV    0x00000010
+#define  HBS_SKIP_FIFO      0x00000020
+#define  HBS_SKIP_SOCKET    0x00000040
+#define  HBS_SKIP_ALL       0x0000007F
+
+/* Mode tests, for hbsFilterCompile(). Each one set must pass. */
+#define  HBS_MODE_OR        0x00000001    /* Any of the mode bits */
+#define  HBS_MODE_AND       0x00000002    /* Exactly the mode bits */
+#define  HBS_MODE_XOR       0x00000004    /* Only bits from the mode bits */
+
+/* Scan flags, for hbsScanNew(). */
+#define  HBS_RECURSIVE      0x00000001    /* Recurse to sub directories */
+#define  HBS_FOLLOW_LINKS   0x00000002    /* Count (and recurse) link targets */
+
+/* Return codes from hbsScan(). */
+#define  HBS_OK             0
+#define  HBS_STOPPED        1             /* A callback asked to stop */
+#define  HBS_ERROR          (-1)          /* The start path could not be read */
+
+/* What failed, for the error callback. */
+#define  HBS_ERR_OPENDIR    1
+#define  HBS_ERR_STAT       2
+
+typedef struct HBS_FILTER   HBS_FILTER;
+typedef struct HBS_SCAN     HBS_SCAN;
+
+/* One counted entry. In a batch, the strings stay valid until the batch */
+/* callback returns. Otherwise, until the entry callback returns. */
+typedef struct
+{
+   const char           *dir;       /* Absolute path of its directory */
+   const char           *name;
+   struct stat          st;         /* lstat() of the entry */
+   unsigned long long   size;       /* Size counted (link target with -l) */
+   int                  depth;      /* 0 for entries in the start path */
+   char                 endChar;    /* '/' for directories, else ' ' */
+} HBS_ENTRY;
+
+typedef struct
+{
+   unsigned long long   bytes,
+                        files,
+                        dirs,
+                        errors;
+} HBS_TOTALS;
+
+/* Callbacks return non zero to stop the scan. */
+typedef int (*HBS_ENTRY_FN)(const HBS_ENTRY *entry, void *data);
+typedef int (*HBS_BATCH_FN)(const HBS_ENTRY *entries, size_t count, void *data);
+typedef void (*HBS_ERROR_FN)(const char *path, int what, int err, void *data);
+
+/* 'pattern' may be NULL to match any name. */
+HBS_FILTER *hbsFilterCompile(const char *pattern, unsigned skipTypes,
+                             unsigned modeTests, unsigned modeBits);
+void hbsFilterFree(HBS_FILTER *filter);
+
+/* The filter must outlive the scan. */
+HBS_SCAN *hbsScanNew(const HBS_FILTER *filter, unsigned flags);
+void hbsScanOnEntry(HBS_SCAN *scan, HBS_ENTRY_FN fn, void *data);
+void hbsScanOnBatch(HBS_SCAN *scan, HBS_BATCH_FN fn, size_t batchSize, void *data);
+void hbsScanOnError(HBS_SCAN *scan, HBS_ERROR_FN fn, void *data);
+
+/* Limit the metadata load on the file system, 0 for no limit on each. */
+/* maxIops caps lstat, link stat and directory open calls per second. */
+/* maxInFlight > 1 spreads the lstat calls over that many threads. A */
+/* targetUsec turns on adaptive mode, which grows and shrinks the number */
+/* in flight (up to maxInFlight, or 32) to hold the average lstat latency */
+/* near the target. Entries still arrive in directory order. */
+int hbsScanThrottle(HBS_SCAN *scan, unsigned maxIops, unsigned maxInFlight,
+                    unsigned targetUsec);
+
+/* Scan one start path. Totals add up across calls. */
+int hbsScan(HBS_SCAN *scan, const char *path);
+void hbsScanTotals(const HBS_SCAN *scan, HBS_TOTALS *totals);
+void hbsScanFree(HBS_SCAN *scan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* libhbs.h */
@@ -0,0 +1,662 @@
+/*  snapshot.c
+ *
+ *  Copyright 2018 Steven Anthony (Tony) Williams
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Snapshots (--snapshot) and snapshot diffs (--diff).
+ *
+ * A snapshot is every counted entry of a search, sorted by path hash and
+ * written one column at a time:
+ *
+ *    SNAPHDR
+ *    ul64    hash[entries]     Path hash (hash of name, seeded by dir hash)
+ *    ul64    size[entries]
+ *    ul64    mtime[entries]
+ *    ul32    dir[entries]      Index into the directory table
+ *    char    type[entries]     'f', 'd', 'l', 'c', 'b', 'p' or 's'
+ *    ul64    dirHash[dirs]
+ *    ul64    dirName[dirs]     Offset of the name in the name table
+ *    char    names[namesSize]  NUL terminated directory paths
+ *
+ * Each column starts on an 8 byte boundary. Numbers are in the byte order
+ * of the machine that wrote them. A diff maps both files and walks the two
+ * hash columns together, so it never holds more than the per directory
+ * totals in memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "hbs.h"
+
+#define  SNAP_MAGIC         "HBSSNAP"
+#define  SNAP_VERSION       1
+#define  RADIX_BITS         16
+#define  RADIX_SIZE         (1 << RADIX_BITS)
+
+#define  Align8(n)          (((n) + 7) & ~(ul64)7)
+
+typedef unsigned int        ul32;
+
+typedef struct
+{
+   char    magic[8];
+   ul64    version,
+           entries,
+           dirs,
+           namesSize;
+} SNAPHDR;
+
+typedef struct
+{
+   ul64    hash,
+           size,
+           mtime;
+   ul32    dir;
+   char    type;
+} SNAPREC;
+
+/* Where each column lives, in bytes from the start of the file. */
+typedef struct
+{
+   ul64    hash,
+           size,
+           mtime,
+           dir,
+           type,
+           dirHash,
+           dirName,
+           names,
+           total;
+} LAYOUT;
+
+/* One mapped snapshot file. */
+typedef struct
+{
+   const char      *name;
+   unsigned char   *map;
+   ul64            mapSize;
+   SNAPHDR         hdr;
+   const ul64      *hash,
+                   *size,
+                   *mtime,
+                   *dirHash,
+                   *dirName;
+   const ul32      *dir;
+   const char      *names;
+} SNAPFILE;
+
+/* Per directory totals for a diff. */
+typedef struct
+{
+   ul64        hash;
+   const char  *name;
+   long long   added,
+               removed,
+               grown,
+               shrunk;
+   ul64        addCount,
+               removeCount,
+               resizeCount;
+} DIRDIFF;
+
+/* Open addressed table of directories, keyed on their path hash. */
+typedef struct
+{
+   ul64    *hash;
+   ul32    *index;      /* Slot holds index + 1, 0 means empty */
+   ul64    mask,
+           used;
+} DIRMAP;
+
+static SNAPREC   *recs = NULL;
+static ul64      recCount = 0,
+                 recMax = 0;
+static char      *names = NULL;
+static ul64      namesSize = 0,
+                 namesMax = 0,
+                 *dirHashes = NULL,
+                 *dirNames = NULL,
+                 dirCount = 0,
+                 dirMax = 0;
+static DIRMAP    dirMap;
+
+/* Cache of the directory the last entry was in. */
+static char      lastDir[BIG_BUF] = "";
+static ul32      lastIndex = 0;
+
+static void *grow(void *ptr, ul64 *max, ul64 need, size_t size, ul64 first)
+{
+   if (need <= *max)
+      return ptr;
+
+   while (*max < need)
+      *max = (*max) ? *max * 2 : first;
+
+   if ((ptr = realloc(ptr, *max * size)) == NULL)
+   {
+      fprintf(stderr, "Out of memory building snapshot\n");
+      exit(1);
+   }
+
+   return ptr;
+}
+
+static void mapInit(DIRMAP *m, ul64 slots)
+{
+   m->mask = slots - 1;
+   m->used = 0;
+   m->hash = (ul64*)calloc(slots, sizeof(ul64));
+   m->index = (ul32*)calloc(slots, sizeof(ul32));
+
+   if (m->hash == NULL || m->index == NULL)
+   {
+      fprintf(stderr, "Out of memory building directory table\n");
+      exit(1);
+   }
+}
+
+static void mapFree(DIRMAP *m)
+{
+   free(m->hash);
+   free(m->index);
+   m->hash = NULL;
+   m->index = NULL;
+}
+
+/* Returns the slot for 'hash', which is either its entry or empty. */
+static ul64 mapSlot(DIRMAP *m, ul64 hash)
+{
+   ul64   h;
+
+   for (h = hash & m->mask;
+        m->index[h] && m->hash[h] != hash;
+        h = (h + 1) & m->mask)
+      ;
+
+   return h;
+}
+
+static void mapPut(DIRMAP *m, ul64 hash, ul32 index)
+{
+   ul64   h;
+
+   /* Keep it under half full. */
+   if ((m->used + 1) * 2 > m->mask + 1)
+   {
+      DIRMAP   old = *m;
+      ul64     x;
+
+      mapInit(m, (old.mask + 1) * 2);
+      for (x = 0; x <= old.mask; x++)
+      {
+         if (old.index[x])
+            mapPut(m, old.hash[x], old.index[x] - 1);
+      }
+      mapFree(&old);
+   }
+
+   h = mapSlot(m, hash);
+   if (m->index[h] == 0)
+      m->used++;
+   m->hash[h] = hash;
+   m->index[h] = index + 1;
+}
+
+static char fileType(mode_t mode)
+{
+   if (S_ISDIR(mode))
+      return 'd';
+   else if (S_ISLNK(mode))
+      return 'l';
+   else if (S_ISCHR(mode))
+      return 'c';
+   else if (S_ISBLK(mode))
+      return 'b';
+   else if (S_ISFIFO(mode))
+      return 'p';
+   else if (S_ISSOCK(mode))
+      return 's';
+
+   return 'f';
+}
+
+static ul32 dirIndex(const char *dir)
+{
+   ul64     hash,
+            len,
+            h;
+
+   if (dirCount && strcmp(dir, lastDir) == 0)
+      return lastIndex;
+
+   if (dirMap.hash == NULL)
+      mapInit(&dirMap, 1024);
+
+   len = strlen(dir);
+   hash = hashBytes(dir, len, 0);
+   h = mapSlot(&dirMap, hash);
+
+   if (dirMap.index[h])
+      lastIndex = dirMap.index[h] - 1;
+   else
+   {
+      if (dirCount == dirMax)
+      {
+         ul64   max = dirMax;
+
+         dirHashes = (ul64*)grow(dirHashes, &max, dirCount + 1, sizeof(ul64), 1024);
+         dirNames = (ul64*)grow(dirNames, &dirMax, dirCount + 1, sizeof(ul64), 1024);
+      }
+      names = (char*)grow(names, &namesMax, namesSize + len + 1, 1, 65536);
+
+      dirHashes[dirCount] = hash;
+      dirNames[dirCount] = namesSize;
+      memcpy(names + namesSize, dir, len + 1);
+      namesSize += len + 1;
+
+      lastIndex = dirCount++;
+      mapPut(&dirMap, hash, lastIndex);
+   }
+
+   strncpy(lastDir, dir, BIG_BUF - 1);
+   return lastIndex;
+}
+
+void snapAdd(const char *dir, const char *name, STAT *s)
+{
+   SNAPREC   *r;
+   ul32      index = dirIndex(dir);
+
+   recs = (SNAPREC*)grow(recs, &recMax, recCount + 1, sizeof(SNAPREC), 4096);
+   r = &recs[recCount++];
+   r->hash = hashBytes(name, strlen(name), dirHashes[index]);
+   r->size = s->st_size;
+   r->mtime = s->st_mtime;
+   r->dir = index;
+   r->type = fileType(s->st_mode);
+}
+
+/* LSD radix sort on the path hash, RADIX_BITS at a time. */
+static void sortRecs(void)
+{
+   SNAPREC   *temp,
+             *from = recs,
+             *to;
+   ul64      *counts,
+             shift,
+             x, sum, c;
+
+   if (recCount < 2)
+      return;
+
+   temp = (SNAPREC*)malloc(recCount * sizeof(SNAPREC));
+   counts = (ul64*)malloc(RADIX_SIZE * sizeof(ul64));
+   if (temp == NULL || counts == NULL)
+   {
+      fprintf(stderr, "Out of memory sorting snapshot\n");
+      exit(1);
+   }
+   to = temp;
+
+   for (shift = 0; shift < 64; shift += RADIX_BITS)
+   {
+      memset(counts, 0, RADIX_SIZE * sizeof(ul64));
+      for (x = 0; x < recCount; x++)
+         counts[(from[x].hash >> shift) & (RADIX_SIZE - 1)]++;
+
+      for (x = sum = 0; x < RADIX_SIZE; x++)
+      {
+         c = counts[x];
+         counts[x] = sum;
+         sum += c;
+      }
+
+      for (x = 0; x < recCount; x++)
+         to[counts[(from[x].hash >> shift) & (RADIX_SIZE - 1)]++] = from[x];
+
+      from = to;
+      to = (from == recs) ? temp : recs;
+   }
+
+   /* An even number of passes leaves the result back in recs. */
+   if (from != recs)
+      memcpy(recs, from, recCount * sizeof(SNAPREC));
+
+   free(counts);
+   free(temp);
+}
+
+static void getLayout(SNAPHDR *hdr, LAYOUT *l)
+{
+   l->hash = Align8(sizeof(SNAPHDR));
+   l->size = l->hash + hdr->entries * sizeof(ul64);
+   l->mtime = l->size + hdr->entries * sizeof(ul64);
+   l->dir = l->mtime + hdr->entries * sizeof(ul64);
+   l->type = Align8(l->dir + hdr->entries * sizeof(ul32));
+   l->dirHash = Align8(l->type + hdr->entries);
+   l->dirName = l->dirHash + hdr->dirs * sizeof(ul64);
+   l->names = l->dirName + hdr->dirs * sizeof(ul64);
+   l->total = l->names + hdr->namesSize;
+}
+
+static void writePad(FILE *fp, ul64 at)
+{
+   static const char   zeros[8] = { 0 };
+
+   fwrite(zeros, 1, Align8(at) - at, fp);
+}
+
+/* Sort the collected entries and write them to 'path'. */
+void snapWrite(const char *path)
+{
+   SNAPHDR   hdr;
+   LAYOUT    l;
+   FILE      *fp;
+   ul64      x;
+   bool      ok;
+
+   sortRecs();
+
+   memset(&hdr, 0, sizeof(hdr));
+   strcpy(hdr.magic, SNAP_MAGIC);
+   hdr.version = SNAP_VERSION;
+   hdr.entries = recCount;
+   hdr.dirs = dirCount;
+   hdr.namesSize = namesSize;
+   getLayout(&hdr, &l);
+
+   if ((fp = fopen(path, "wb")) == NULL)
+   {
+      fprintf(stderr, "Could not create snapshot: %s [%s]\n", path, strerror(errno));
+      return;
+   }
+   setvbuf(fp, NULL, _IOFBF, 1024 * 1024);
+
+   fwrite(&hdr, sizeof(hdr), 1, fp);
+   writePad(fp, sizeof(hdr));
+   for (x = 0; x < recCount; x++)
+      fwrite(&recs[x].hash, sizeof(ul64), 1, fp);
+   for (x = 0; x < recCount; x++)
+      fwrite(&recs[x].size, sizeof(ul64), 1, fp);
+   for (x = 0; x < recCount; x++)
+      fwrite(&recs[x].mtime, sizeof(ul64), 1, fp);
+   for (x = 0; x < recCount; x++)
+      fwrite(&recs[x].dir, sizeof(ul32), 1, fp);
+   writePad(fp, l.dir + recCount * sizeof(ul32));
+   for (x = 0; x < recCount; x++)
+      fputc(recs[x].type, fp);
+   writePad(fp, l.type + recCount);
+   fwrite(dirHashes, sizeof(ul64), dirCount, fp);
+   fwrite(dirNames, sizeof(ul64), dirCount, fp);
+   fwrite(names, 1, namesSize, fp);
+
+   ok = (ferror(fp) == 0);
+   if (fclose(fp) != 0 || !ok)
+      fprintf(stderr, "Could not write snapshot: %s [%s]\n", path, strerror(errno));
+   else
+      printf("Snapshot: %Ld entries in %Ld directories written to %s\n\n",
+             recCount, dirCount, path);
+
+   free(recs);
+   free(names);
+   free(dirHashes);
+   free(dirNames);
+   mapFree(&dirMap);
+   recs = NULL;
+   names = NULL;
+   dirHashes = dirNames = NULL;
+   recCount = recMax = namesSize = namesMax = dirCount = dirMax = 0;
+   lastDir[0] = '\0';
+}
+
+static bool snapOpen(SNAPFILE *sf, const char *path)
+{
+   LAYOUT   l;
+   STAT     s;
+   int      fd;
+
+   memset(sf, 0, sizeof(SNAPFILE));
+   sf->name = path;
+
+   if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &s) != 0)
+   {
+      fprintf(stderr, "Could not open snapshot: %s [%s]\n", path, strerror(errno));
+      if (fd >= 0)
+         close(fd);
+      return false;
+   }
+
+   if ((ul64)s.st_size < sizeof(SNAPHDR) ||
+       pread(fd, &sf->hdr, sizeof(SNAPHDR), 0) != sizeof(SNAPHDR) ||
+       memcmp(sf->hdr.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0 ||
+       sf->hdr.version != SNAP_VERSION)
+   {
+      fprintf(stderr, "Not an hbs snapshot: %s\n", path);
+      close(fd);
+      return false;
+   }
+
+   getLayout(&sf->hdr, &l);
+   if (l.total != (ul64)s.st_size)
+   {
+      fprintf(stderr, "Snapshot is damaged: %s\n", path);
+      close(fd);
+      return false;
+   }
+
+   sf->mapSize = l.total;
+   sf->map = (unsigned char*)mmap(NULL, sf->mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+
+   if (sf->map == MAP_FAILED)
+   {
+      fprintf(stderr, "Could not map snapshot: %s [%s]\n", path, strerror(errno));
+      sf->map = NULL;
+      return false;
+   }
+   madvise(sf->map, sf->mapSize, MADV_SEQUENTIAL);
+
+   sf->hash = (const ul64*)(sf->map + l.hash);
+   sf->size = (const ul64*)(sf->map + l.size);
+   sf->mtime = (const ul64*)(sf->map + l.mtime);
+   sf->dir = (const ul32*)(sf->map + l.dir);
+   sf->dirHash = (const ul64*)(sf->map + l.dirHash);
+   sf->dirName = (const ul64*)(sf->map + l.dirName);
+   sf->names = (const char*)(sf->map + l.names);
+
+   return true;
+}
+
+static void snapClose(SNAPFILE *sf)
+{
+   if (sf->map)
+      munmap(sf->map, sf->mapSize);
+   sf->map = NULL;
+}
+
+static DIRDIFF   *diffs = NULL;
+static ul64      diffCount = 0,
+                 diffMax = 0;
+
+/* Find (or add) the totals for entry 'x' of snapshot 'sf'. */
+static DIRDIFF *dirDiff(SNAPFILE *sf, ul64 x)
+{
+   ul32      index = sf->dir[x];
+   ul64      hash,
+             h;
+   DIRDIFF   *d;
+
+   if (index >= sf->hdr.dirs)
+   {
+      fprintf(stderr, "Snapshot is damaged: %s\n", sf->name);
+      exit(1);
+   }
+
+   hash = sf->dirHash[index];
+   h = mapSlot(&dirMap, hash);
+   if (dirMap.index[h])
+      return &diffs[dirMap.index[h] - 1];
+
+   diffs = (DIRDIFF*)grow(diffs, &diffMax, diffCount + 1, sizeof(DIRDIFF), 1024);
+   d = &diffs[diffCount];
+   memset(d, 0, sizeof(DIRDIFF));
+   d->hash = hash;
+   d->name = (sf->dirName[index] < sf->hdr.namesSize) ?
+             sf->names + sf->dirName[index] : "?";
+   mapPut(&dirMap, hash, diffCount);
+
+   return &diffs[diffCount++];
+}
+
+static long long netChange(const DIRDIFF *d)
+{
+   return d->added - d->removed + d->grown - d->shrunk;
+}
+
+/* Biggest growth first. */
+static int cmpDiff(const void *a, const void *b)
+{
+   long long   na = netChange((const DIRDIFF*)a),
+               nb = netChange((const DIRDIFF*)b);
+
+   if (na != nb)
+      return (na > nb) ? -1 : 1;
+   return strcmp(((const DIRDIFF*)a)->name, ((const DIRDIFF*)b)->name);
+}
+
+static void printBytes(const char *label, ul64 count, ul64 bytes)
+{
+   double   scaled;
+   char     scaleChr;
+
+   scaled = scaleCount(bytes, &scaleChr);
+   printf("%-9s %012Ld (%.1f%c) bytes in %Ld file(s)\n",
+          label, bytes, scaled, scaleChr, count);
+}
+
+/* Merge join the snapshots 'before' and 'after' on path hash, and report */
+/* what was added, removed and resized, per directory. */
+void snapDiff(const char *before, const char *after)
+{
+   SNAPFILE    a, b;
+   DIRDIFF     *d;
+   ul64        x = 0,
+               y = 0,
+               added = 0, addCount = 0,
+               removed = 0, removeCount = 0,
+               grown = 0, growCount = 0,
+               shrunk = 0, shrinkCount = 0,
+               touchCount = 0;
+   long long   net;
+   double      scaled;
+   char        scaleChr;
+
+   if (!snapOpen(&a, before))
+      return;
+   if (!snapOpen(&b, after))
+   {
+      snapClose(&a);
+      return;
+   }
+
+   mapInit(&dirMap, 1024);
+
+   while (x < a.hdr.entries || y < b.hdr.entries)
+   {
+      if (y == b.hdr.entries ||
+          (x < a.hdr.entries && a.hash[x] < b.hash[y]))
+      {
+         d = dirDiff(&a, x);
+         d->removed += a.size[x];
+         d->removeCount++;
+         removed += a.size[x];
+         removeCount++;
+         x++;
+      }
+      else if (x == a.hdr.entries || b.hash[y] < a.hash[x])
+      {
+         d = dirDiff(&b, y);
+         d->added += b.size[y];
+         d->addCount++;
+         added += b.size[y];
+         addCount++;
+         y++;
+      }
+      else
+      {
+         if (a.size[x] != b.size[y])
+         {
+            d = dirDiff(&b, y);
+            if (b.size[y] > a.size[x])
+            {
+               d->grown += b.size[y] - a.size[x];
+               grown += b.size[y] - a.size[x];
+               growCount++;
+            }
+            else
+            {
+               d->shrunk += a.size[x] - b.size[y];
+               shrunk += a.size[x] - b.size[y];
+               shrinkCount++;
+            }
+            d->resizeCount++;
+         }
+         else if (a.mtime[x] != b.mtime[y])
+            touchCount++;
+         x++;
+         y++;
+      }
+   }
+
+   qsort(diffs, diffCount, sizeof(DIRDIFF), cmpDiff);
+
+   printf("Snapshot diff: %s -> %s\n\n", before, after);
+
+   for (x = 0; x < diffCount; x++)
+   {
+      d = &diffs[x];
+      printf("%+14Ld %s/ (%Ld added, %Ld removed, %Ld resized)\n",
+             netChange(d), d->name, d->addCount, d->removeCount, d->resizeCount);
+   }
+
+   printf("\n");
+   printBytes("Added:", addCount, added);
+   printBytes("Removed:", removeCount, removed);
+   printBytes("Grown:", growCount, grown);
+   printBytes("Shrunk:", shrinkCount, shrunk);
+   printf("%-9s %Ld file(s) changed without changing size\n", "Touched:", touchCount);
+
+   net = (long long)(added + grown) - (long long)(removed + shrunk);
+   scaled = scaleCount((net < 0) ? -net : net, &scaleChr);
+   printf("\n%+013Ld (%c%.1f%c) net change in %Ld director%s\n\n",
+          net, (net < 0) ? '-' : '+', scaled, scaleChr, diffCount,
+          (diffCount == 1) ? "y" : "ies");
+
+   free(diffs);
+   diffs = NULL;
+   diffCount = diffMax = 0;
+   mapFree(&dirMap);
+   snapClose(&a);
+   snapClose(&b);
+}
+
+/* snapshot.c */
@@ -0,0 +1,313 @@
+/*  throttle.c
+ *
+ *  Copyright 2018 Steven Anthony (Tony) Williams
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Metadata load limits for a scan.
+ *
+ * Every lstat, link stat and directory open first takes a slot from a
+ * rate limiter (max IOPS). The lstat calls for a directory can also be
+ * spread over a pool of threads, with no more than 'window' of them in
+ * flight at once. In adaptive mode the window follows the latency of each
+ * call (AIMD): one more after a window's worth of calls under the target,
+ * half as many as soon as the average goes over it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "hbs.h"
+
+#define  ADAPT_MAX          32            /* Window cap when none is given */
+#define  ADAPT_START        4
+#define  EWMA_SHIFT         3             /* Latency average weight, 1/8 */
+#define  NSEC               1000000000LL
+
+typedef long long           ns64;
+
+struct THROTTLE
+{
+   /* Rate limit */
+   pthread_mutex_t   rateLock;
+   ns64              interval,     /* Between ops, 0 for no limit */
+                     burst,
+                     nextOp;
+
+   /* Concurrency limit */
+   pthread_mutex_t   lock;
+   pthread_cond_t    work,
+                     done;
+   pthread_t         *threads;
+   unsigned          nThreads,
+                     window,
+                     maxWindow,
+                     sinceAdjust;
+   bool              isAdaptive,
+                     isQuit;
+   ns64              target,
+                     avgLatency;
+
+   /* The current job, the lstat calls for one chunk of a directory */
+   int               dirfd;
+   char              **names;
+   STAT              *stats;
+   int               *errs;
+   size_t            count,
+                     next,
+                     finished;
+};
+
+typedef struct
+{
+   THROTTLE   *t;
+   unsigned   id;
+} WORKER;
+
+static ns64 now(void)
+{
+   struct timespec   ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (ns64)ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+THROTTLE *throttleNew(unsigned maxIops, unsigned maxInFlight, unsigned targetUsec)
+{
+   THROTTLE   *t;
+
+   if ((t = (THROTTLE*)calloc(1, sizeof(THROTTLE))) == NULL)
+      return NULL;
+
+   pthread_mutex_init(&t->rateLock, NULL);
+   pthread_mutex_init(&t->lock, NULL);
+   pthread_cond_init(&t->work, NULL);
+   pthread_cond_init(&t->done, NULL);
+
+   if (maxIops)
+   {
+      t->interval = NSEC / maxIops;
+      /* Allow up to a tenth of a second of ops to bunch up. */
+      t->burst = NSEC / 10;
+   }
+
+   t->isAdaptive = (targetUsec) ? true : false;
+   t->target = (ns64)targetUsec * 1000;
+   t->maxWindow = (maxInFlight) ? maxInFlight : (t->isAdaptive) ? ADAPT_MAX : 1;
+   t->window = (t->isAdaptive && ADAPT_START < t->maxWindow) ? ADAPT_START : t->maxWindow;
+
+   return t;
+}
+
+void throttleFree(THROTTLE *t)
+{
+   unsigned   x;
+
+   if (t == NULL)
+      return;
+
+   pthread_mutex_lock(&t->lock);
+   t->isQuit = true;
+   pthread_cond_broadcast(&t->work);
+   pthread_mutex_unlock(&t->lock);
+
+   for (x = 0; x < t->nThreads; x++)
+      pthread_join(t->threads[x], NULL);
+   free(t->threads);
+
+   pthread_cond_destroy(&t->work);
+   pthread_cond_destroy(&t->done);
+   pthread_mutex_destroy(&t->lock);
+   pthread_mutex_destroy(&t->rateLock);
+   free(t);
+}
+
+/* True if lstat calls should go through the thread pool. */
+bool throttleIsParallel(THROTTLE *t)
+{
+   return (t->maxWindow > 1);
+}
+
+/* Wait for a slot under the IOPS limit. */
+void throttleWait(THROTTLE *t)
+{
+   ns64              slot,
+                     current;
+   struct timespec   ts;
+
+   if (t->interval == 0)
+      return;
+
+   current = now();
+
+   pthread_mutex_lock(&t->rateLock);
+   if (t->nextOp < current - t->burst)
+      t->nextOp = current - t->burst;
+   slot = t->nextOp;
+   t->nextOp += t->interval;
+   pthread_mutex_unlock(&t->rateLock);
+
+   if (slot > current)
+   {
+      ts.tv_sec = (slot - current) / NSEC;
+      ts.tv_nsec = (slot - current) % NSEC;
+      while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+         ;
+   }
+}
+
+/* AIMD on the average latency. Called with the lock held. */
+static void adapt(THROTTLE *t, ns64 latency)
+{
+   if (t->avgLatency == 0)
+      t->avgLatency = latency;
+   else
+      t->avgLatency += (latency - t->avgLatency) >> EWMA_SHIFT;
+
+   if (t->avgLatency > t->target)
+   {
+      /* Only back off once per window, or one slow patch empties it. */
+      if (t->window > 1 && t->sinceAdjust >= t->window / 2)
+      {
+         t->window /= 2;
+         t->sinceAdjust = 0;
+      }
+      else
+         t->sinceAdjust++;
+   }
+   else if (++t->sinceAdjust >= t->window)
+   {
+      if (t->window < t->maxWindow)
+      {
+         t->window++;
+         pthread_cond_broadcast(&t->work);
+      }
+      t->sinceAdjust = 0;
+   }
+}
+
+static void *worker(void *arg)
+{
+   WORKER     *w = (WORKER*)arg;
+   THROTTLE   *t = w->t;
+   size_t     x;
+   ns64       start,
+              latency;
+   int        err;
+
+   pthread_mutex_lock(&t->lock);
+
+   for (;;)
+   {
+      /* Workers past the window sit this one out. */
+      while (!t->isQuit && (t->next >= t->count || w->id >= t->window))
+         pthread_cond_wait(&t->work, &t->lock);
+
+      if (t->isQuit)
+         break;
+
+      x = t->next++;
+      pthread_mutex_unlock(&t->lock);
+
+      throttleWait(t);
+      start = now();
+      err = (fstatat(t->dirfd, t->names[x], &t->stats[x], AT_SYMLINK_NOFOLLOW) != 0) ? errno : 0;
+      latency = now() - start;
+
+      pthread_mutex_lock(&t->lock);
+      t->errs[x] = err;
+      if (t->isAdaptive)
+         adapt(t, latency);
+      if (++t->finished == t->count)
+         pthread_cond_signal(&t->done);
+   }
+
+   pthread_mutex_unlock(&t->lock);
+   free(w);
+
+   return NULL;
+}
+
+static bool startWorkers(THROTTLE *t)
+{
+   if ((t->threads = (pthread_t*)malloc(t->maxWindow * sizeof(pthread_t))) == NULL)
+      return false;
+
+   for (; t->nThreads < t->maxWindow; t->nThreads++)
+   {
+      WORKER   *w = (WORKER*)malloc(sizeof(WORKER));
+
+      if (w == NULL)
+         break;
+      w->t = t;
+      w->id = t->nThreads;
+
+      if (pthread_create(&t->threads[t->nThreads], NULL, worker, w) != 0)
+      {
+         free(w);
+         break;
+      }
+   }
+
+   /* Run with what started. */
+   if (t->nThreads == 0)
+   {
+      free(t->threads);
+      t->threads = NULL;
+      t->maxWindow = t->window = 1;
+      return false;
+   }
+   else if (t->nThreads < t->maxWindow)
+   {
+      t->maxWindow = t->nThreads;
+      if (t->window > t->maxWindow)
+         t->window = t->maxWindow;
+   }
+
+   return true;
+}
+
+/* lstat 'count' names in 'dirfd' across the pool. Each errs[x] is 0 or */
+/* the errno for that name. Returns false if the pool can't start. */
+bool throttleStatAll(THROTTLE *t, int dirfd, char **names, STAT *stats,
+                     int *errs, size_t count)
+{
+   if (t->threads == NULL && !startWorkers(t))
+      return false;
+
+   pthread_mutex_lock(&t->lock);
+   t->dirfd = dirfd;
+   t->names = names;
+   t->stats = stats;
+   t->errs = errs;
+   t->count = count;
+   t->next = 0;
+   t->finished = 0;
+   pthread_cond_broadcast(&t->work);
+
+   while (t->finished < t->count)
+      pthread_cond_wait(&t->done, &t->lock);
+
+   t->count = 0;
+   pthread_mutex_unlock(&t->lock);
+
+   return true;
+}
+
+/* throttle.c */